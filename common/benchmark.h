@@ -0,0 +1,112 @@
+// Chris Nauroth
+// Intel Threading Challenge 2011
+// Benchmark Support
+
+// Shared by the -bench modes of mazeoflife, primesums and runningnumbers.  Each
+// program supplies a functor that runs its core function once on one input and
+// returns the amount of work done (states visited, primes checked, cycles
+// stepped).  runCase times the functor repeatedly with a fixed number of TBB
+// worker threads, and writeResults prints median and 95th percentile latency,
+// throughput and the thread-scaling curve as a JSON object, so results from
+// different commits can be compared.
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <tbb/task_scheduler_init.h>
+#include <tbb/tick_count.h>
+
+namespace benchmark {
+
+struct Result {
+    std::string name;
+    int threads;
+    std::vector<double> seconds;
+    double work;
+    bool ok;
+};
+
+// thread counts 1, 2, 4, ... up to and including the default number of threads
+inline std::vector<int> threadCounts() {
+    int maxThreads = tbb::task_scheduler_init::default_num_threads();
+    std::vector<int> counts;
+
+    for (int threads = 1; threads < maxThreads; threads *= 2)
+        counts.push_back(threads);
+
+    counts.push_back(maxThreads);
+    return counts;
+}
+
+// nearest-rank percentile of an already sorted, non-empty vector
+inline double percentile(const std::vector<double>& sorted, const double p) {
+    size_t rank = static_cast<size_t>(p * sorted.size() + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > sorted.size())
+        rank = sorted.size();
+    return sorted[rank - 1];
+}
+
+// Runs c() the given number of times with the given number of threads.  c()
+// returns the work done by one run.  c.ok() reports whether the last run
+// produced the known answer.
+template <typename Case>
+Result runCase(const std::string& name, const int threads, const size_t runs,
+               Case& c) {
+    tbb::task_scheduler_init init(threads);
+    Result result;
+    result.name = name;
+    result.threads = threads;
+    result.work = 0;
+    result.ok = true;
+
+    for (size_t i = 0; i < runs; ++i) {
+        tbb::tick_count begin = tbb::tick_count::now();
+        result.work = c();
+        result.seconds.push_back((tbb::tick_count::now() - begin).seconds());
+        result.ok = result.ok && c.ok();
+    }
+
+    std::sort(result.seconds.begin(), result.seconds.end());
+    return result;
+}
+
+// Writes results as a JSON object.  Names are file names, ranges and hex
+// strings, so they never need escaping.
+inline void writeResults(std::ostream& out, const std::string& program,
+                         const std::string& unit,
+                         const std::vector<Result>& results) {
+    std::streamsize precision = out.precision(9);
+    out << "{\"program\": \"" << program << "\", \"unit\": \"" << unit
+        << "\", \"cases\": [";
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& result = results[i];
+        double median = percentile(result.seconds, 0.5);
+
+        out << (i > 0 ? "," : "") << std::endl
+            << "  {\"name\": \"" << result.name << "\""
+            << ", \"threads\": " << result.threads
+            << ", \"runs\": " << result.seconds.size()
+            << ", \"ok\": " << (result.ok ? "true" : "false")
+            << ", \"median_sec\": " << median
+            << ", \"p95_sec\": " << percentile(result.seconds, 0.95)
+            << ", \"min_sec\": " << result.seconds.front()
+            << ", \"work\": " << result.work
+            << ", \"throughput\": " << (median > 0 ? result.work / median : 0)
+            << "}";
+    }
+
+    out << "]}" << std::endl;
+    out.precision(precision);
+}
+
+}
+
+#endif
@@ -0,0 +1,96 @@
+// Chris Nauroth
+// Intel Threading Challenge 2011
+// Budget
+
+// ./budget seconds kilobytes command args... runs a command and fails if it
+// exits unsuccessfully, runs longer than the wall time budget, or reaches a peak
+// resident set size above the memory budget.  A command that overruns the time
+// budget is killed rather than waited for.  Used by the check targets to catch
+// performance regressions along with wrong answers.
+
+#include <iostream>
+#include <sstream>
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+double now() {
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        cerr << "Must specify wall time budget in seconds, peak RSS budget in "
+                "kilobytes, and command." << endl;
+        return 1;
+    }
+
+    double maxSeconds;
+    long maxKilobytes;
+    istringstream(argv[1]) >> maxSeconds;
+    istringstream(argv[2]) >> maxKilobytes;
+
+    double begin = now();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        cerr << "fork failed" << endl;
+        return 1;
+    }
+    else if (0 == pid) {
+        execvp(argv[3], argv + 3);
+        cerr << "exec failed: " << argv[3] << endl;
+        _exit(127);
+    }
+
+    // poll instead of blocking in wait4, so that a runaway command can be killed
+    int status;
+    rusage usage;
+    bool killed = false;
+    timespec pollInterval = { 0, 10 * 1000 * 1000 };
+
+    for (;;) {
+        pid_t waited = wait4(pid, &status, WNOHANG, &usage);
+
+        if (waited > 0)
+            break;
+        else if (waited < 0 && EINTR != errno) {
+            cerr << "wait4 failed: " << strerror(errno) << endl;
+            kill(pid, SIGKILL);
+            return 1;
+        }
+
+        if (!killed && now() - begin > maxSeconds) {
+            kill(pid, SIGKILL);
+            killed = true;
+        }
+
+        nanosleep(&pollInterval, NULL);
+    }
+
+    double seconds = now() - begin;
+    // ru_maxrss is in kilobytes on Linux
+    long kilobytes = usage.ru_maxrss;
+
+    bool succeeded = WIFEXITED(status) && 0 == WEXITSTATUS(status);
+    bool inBudget = !killed && seconds <= maxSeconds && kilobytes <= maxKilobytes;
+
+    cerr << argv[3] << ": " << seconds << " sec (budget " << maxSeconds << "), "
+         << kilobytes << " KB (budget " << maxKilobytes << ")"
+         << (killed ? ", killed" : "")
+         << (succeeded ? "" : ", failed")
+         << (inBudget ? "" : ", over budget") << endl;
+
+    return (succeeded && inBudget) ? 0 : 1;
+}
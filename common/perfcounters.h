@@ -0,0 +1,332 @@
+// Chris Nauroth
+// Intel Threading Challenge 2011
+// Hardware Performance Counters
+
+// Opt-in instrumentation of named regions with Linux perf_event_open.  Building
+// with -DPERF_COUNTERS turns it on.  Otherwise PERF_REGION and PERF_REPORT
+// expand to nothing, and none of this is compiled.
+//
+// PERF_REGION("expandSuccessors") counts cycles, instructions, L1D read misses,
+// LLC read misses and branch misses from that point to the end of the enclosing
+// scope.  Counts are inclusive of nested regions.  Each thread opens its own
+// counter group the first time it enters a region, and accumulates counts per
+// region without locking.  PERF_REPORT("mazeoflife") is called once all threads are
+// done.  It prints a table per region and thread to stderr and writes the same
+// data to mazeoflife-perf.json.
+//
+// Each region entry and exit costs a read() system call, so regions should wrap
+// whole functions rather than single loop iterations.  If the kernel refuses to
+// open an event (see /proc/sys/kernel/perf_event_paranoid), that event is
+// reported as unavailable, but calls are still counted.
+
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#ifdef PERF_COUNTERS
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <tbb/mutex.h>
+
+namespace perfcounters {
+
+enum Event {
+    CYCLES,
+    INSTRUCTIONS,
+    L1D_MISSES,
+    LLC_MISSES,
+    BRANCH_MISSES,
+    EVENT_COUNT
+};
+
+inline const char* eventName(const size_t event) {
+    static const char* const names[EVENT_COUNT] = {
+        "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+    };
+    return names[event];
+}
+
+struct Counts {
+    uint64_t calls;
+    uint64_t values[EVENT_COUNT];
+
+    Counts():calls(0) {
+        std::fill(this->values, this->values + EVENT_COUNT, 0);
+    }
+
+    void add(const Counts& other) {
+        this->calls += other.calls;
+
+        for (size_t e = 0; e < EVENT_COUNT; ++e)
+            this->values[e] += other.values[e];
+    }
+};
+
+typedef std::map<std::string, Counts> RegionCounts;
+
+inline int openEvent(const uint32_t type, const uint64_t config, const int groupFd) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+// counter group and per-region counts for one thread
+class ThreadCounters {
+public:
+    explicit ThreadCounters(const size_t id):_id(id), _leader(-1), _opened(0) {
+        static const uint32_t types[EVENT_COUNT] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+            PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+        };
+        static const uint64_t configs[EVENT_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+
+        // The first event that opens leads the group, so that all events are
+        // read together with one read() call.  _slots maps each event to its
+        // position in the group, or -1 if it could not be opened.
+        for (size_t e = 0; e < EVENT_COUNT; ++e) {
+            int fd = openEvent(types[e], configs[e], this->_leader);
+
+            if (fd < 0) {
+                this->_slots[e] = -1;
+            }
+            else {
+                if (this->_leader < 0)
+                    this->_leader = fd;
+
+                this->_slots[e] = this->_opened++;
+            }
+        }
+    }
+
+    size_t id() const {
+        return this->_id;
+    }
+
+    bool available(const size_t event) const {
+        return this->_slots[event] >= 0;
+    }
+
+    const RegionCounts& regions() const {
+        return this->_regions;
+    }
+
+    void read(uint64_t values[EVENT_COUNT]) const {
+        uint64_t group[1 + EVENT_COUNT];
+        std::fill(values, values + EVENT_COUNT, 0);
+
+        if (this->_leader < 0 ||
+            ::read(this->_leader, group, sizeof(group)) < ssize_t(sizeof(uint64_t)))
+            return;
+
+        for (size_t e = 0; e < EVENT_COUNT; ++e) {
+            if (this->_slots[e] >= 0 && uint64_t(this->_slots[e]) < group[0])
+                values[e] = group[1 + this->_slots[e]];
+        }
+    }
+
+    void record(const char* const region, const uint64_t begin[EVENT_COUNT],
+                const uint64_t end[EVENT_COUNT]) {
+        Counts& counts = this->_regions[region];
+        ++counts.calls;
+
+        for (size_t e = 0; e < EVENT_COUNT; ++e)
+            counts.values[e] += end[e] - begin[e];
+    }
+
+private:
+    const size_t _id;
+    int _leader;
+    int _opened;
+    int _slots[EVENT_COUNT];
+    RegionCounts _regions;
+};
+
+inline tbb::mutex& registryMutex() {
+    static tbb::mutex mutex;
+    return mutex;
+}
+
+inline std::vector<ThreadCounters*>& registry() {
+    static std::vector<ThreadCounters*> threads;
+    return threads;
+}
+
+// counters for the calling thread, opened on first use
+inline ThreadCounters& threadCounters() {
+    static __thread ThreadCounters* counters = NULL;
+
+    if (NULL == counters) {
+        tbb::mutex::scoped_lock lock(registryMutex());
+        counters = new ThreadCounters(registry().size());
+        registry().push_back(counters);
+    }
+
+    return *counters;
+}
+
+// counts events from construction to destruction
+class Region {
+public:
+    explicit Region(const char* const name):
+        _name(name), _counters(threadCounters()) {
+        this->_counters.read(this->_begin);
+    }
+
+    ~Region() {
+        uint64_t end[EVENT_COUNT];
+        this->_counters.read(end);
+        this->_counters.record(this->_name, this->_begin, end);
+    }
+
+private:
+    const char* const _name;
+    ThreadCounters& _counters;
+    uint64_t _begin[EVENT_COUNT];
+};
+
+inline void writeRow(std::ostream& out, const std::string& region,
+                     const std::string& thread, const Counts& counts,
+                     const bool available[EVENT_COUNT]) {
+    out << std::left << std::setw(24) << region << std::setw(8) << thread
+        << std::right << std::setw(12) << counts.calls;
+
+    for (size_t e = 0; e < EVENT_COUNT; ++e) {
+        if (available[e])
+            out << std::setw(16) << counts.values[e];
+        else
+            out << std::setw(16) << "n/a";
+    }
+
+    if (available[CYCLES] && available[INSTRUCTIONS] && counts.values[CYCLES] > 0)
+        out << std::setw(8) << std::fixed << std::setprecision(2)
+            << double(counts.values[INSTRUCTIONS]) / counts.values[CYCLES];
+    else
+        out << std::setw(8) << "n/a";
+
+    out << std::endl;
+}
+
+inline void writeJson(std::ostream& out, const std::string& region,
+                      const std::string& thread, const Counts& counts,
+                      const bool available[EVENT_COUNT]) {
+    out << "  {\"region\": \"" << region << "\", \"thread\": " << thread
+        << ", \"calls\": " << counts.calls;
+
+    for (size_t e = 0; e < EVENT_COUNT; ++e) {
+        out << ", \"" << eventName(e) << "\": ";
+
+        if (available[e])
+            out << counts.values[e];
+        else
+            out << "null";
+    }
+
+    out << "}";
+}
+
+// Prints the table to stderr and writes <program>-perf.json.  Rows are per
+// region and thread, followed by an "all" row summing the region over threads.
+inline void report(const std::string& program) {
+    tbb::mutex::scoped_lock lock(registryMutex());
+    const std::vector<ThreadCounters*>& threads = registry();
+
+    // an event counts as available only if every thread could open it
+    bool available[EVENT_COUNT];
+    for (size_t e = 0; e < EVENT_COUNT; ++e) {
+        available[e] = !threads.empty();
+
+        for (size_t t = 0; t < threads.size(); ++t)
+            available[e] = available[e] && threads[t]->available(e);
+    }
+
+    RegionCounts totals;
+    for (size_t t = 0; t < threads.size(); ++t) {
+        for (RegionCounts::const_iterator i = threads[t]->regions().begin();
+             i != threads[t]->regions().end(); ++i) {
+
+            totals[i->first].add(i->second);
+        }
+    }
+
+    std::ostream& out = std::cerr;
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    std::ofstream json((program + "-perf.json").c_str());
+    json << "{\"program\": \"" << program << "\", \"regions\": [";
+    bool first = true;
+
+    out << std::left << std::setw(24) << "region" << std::setw(8) << "thread"
+        << std::right << std::setw(12) << "calls";
+    for (size_t e = 0; e < EVENT_COUNT; ++e)
+        out << std::setw(16) << eventName(e);
+    out << std::setw(8) << "ipc" << std::endl;
+
+    for (RegionCounts::const_iterator i = totals.begin(); i != totals.end(); ++i) {
+        for (size_t t = 0; t < threads.size(); ++t) {
+            RegionCounts::const_iterator counts = threads[t]->regions().find(i->first);
+
+            if (counts != threads[t]->regions().end()) {
+                std::ostringstream thread;
+                thread << threads[t]->id();
+                writeRow(out, i->first, thread.str(), counts->second, available);
+
+                json << (first ? "" : ",") << std::endl;
+                writeJson(json, i->first, thread.str(), counts->second, available);
+                first = false;
+            }
+        }
+
+        writeRow(out, i->first, "all", i->second, available);
+        json << (first ? "" : ",") << std::endl;
+        writeJson(json, i->first, "\"all\"", i->second, available);
+        first = false;
+    }
+
+    json << "]}" << std::endl;
+    out.flags(flags);
+    out.precision(precision);
+}
+
+}
+
+#define PERF_COUNTERS_CONCAT2(a, b) a##b
+#define PERF_COUNTERS_CONCAT(a, b) PERF_COUNTERS_CONCAT2(a, b)
+#define PERF_REGION(name) \
+    perfcounters::Region PERF_COUNTERS_CONCAT(perfRegion, __LINE__)(name)
+#define PERF_REPORT(program) perfcounters::report(program)
+
+#else
+
+#define PERF_REGION(name)
+#define PERF_REPORT(program)
+
+#endif
+
+#endif
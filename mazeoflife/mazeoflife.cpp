@@ -11,6 +11,33 @@
 // Threading Building Blocks.  The STL priority_queue is not thread-safe, so
 // access is controlled by locking a mutex.  This solution eagerly seeks a
 // solution path in minimal time, but it does not always find the shortest path.
+//
+// Passing 1 as an extra argument after the output file turns on symmetry
+// reduction.  Mirroring or rotating the whole grid commutes with the Life rules,
+// so if a mirror image leaves the goal in place, a grid and its mirror image
+// have mirrored solutions.  The symmetries that fix the goal are found once at
+// load time, and each grid is mapped to a canonical representative (the least
+// of its images) before the visited check, so each equivalence class is only
+// explored once.  Games keep their real grids and moves, so the solution path
+// needs no un-mirroring.
+//
+// All successors of a game are expanded in one pass by expandSuccessors, which
+// computes the next generation of the cells they share once and then patches
+// the 3x3 block around each new position of the intelligent cell.
+//
+// Built as mazeoflife-perf, the solver reports hardware counters for the
+// regions Apply, queueNextMoves and expandSuccessors, and -verify reports them
+// for move (see ../common/perfcounters.h).
+//
+// ./mazeoflife -bench runs gridin1.txt pathout1.txt ... runs findSolution on
+// each grid the given number of times per thread count, and prints timings as
+// JSON (see ../common/benchmark.h).
+//
+// ./mazeoflife -verify gridin1.txt pathout1.txt out.txt checks a solver output
+// against the expected output.  Paths found depend on thread timing, so rather
+// than comparing strings, both paths are replayed through the Life rules and
+// must be legal and end on the goal.  If the expected output is "no solution",
+// the solver output must be too.
 
 #include <algorithm>
 #include <fstream>
@@ -26,6 +53,9 @@
 #include <tbb/parallel_while.h>
 #include <tbb/tick_count.h>
 
+#include "../common/benchmark.h"
+#include "../common/perfcounters.h"
+
 using namespace std;
 
 enum Cell {
@@ -65,6 +95,16 @@ struct Grid {
 
         return true;
     }
+
+    // arbitrary total order, used to pick canonical representatives
+    bool operator<(const Grid& other) const {
+        if (this->iY != other.iY)
+            return this->iY < other.iY;
+        else if (this->iX != other.iX)
+            return this->iX < other.iX;
+        else
+            return this->cells < other.cells;
+    }
 };
 
 struct Game {
@@ -92,6 +132,88 @@ public:
     }
 };
 
+// The 8 symmetries of a square.  Only the first 4 apply to a grid that is not
+// square.
+enum Symmetry {
+    IDENTITY,
+    MIRROR_X,
+    MIRROR_Y,
+    ROTATE_180,
+    TRANSPOSE,
+    ANTI_TRANSPOSE,
+    ROTATE_90,
+    ROTATE_270
+};
+
+// symmetries other than the identity that fix the goal, found at load time
+static vector<Symmetry> symmetries;
+
+void transformPoint(const Symmetry symmetry, const size_t dimX, const size_t dimY,
+                    const size_t x, const size_t y, size_t& tx, size_t& ty) {
+    switch (symmetry) {
+    case IDENTITY:
+    default:             tx = x;            ty = y;            break;
+    case MIRROR_X:       tx = dimX - 1 - x; ty = y;            break;
+    case MIRROR_Y:       tx = x;            ty = dimY - 1 - y; break;
+    case ROTATE_180:     tx = dimX - 1 - x; ty = dimY - 1 - y; break;
+    case TRANSPOSE:      tx = y;            ty = x;            break;
+    case ANTI_TRANSPOSE: tx = dimY - 1 - y; ty = dimX - 1 - x; break;
+    case ROTATE_90:      tx = dimY - 1 - y; ty = x;            break;
+    case ROTATE_270:     tx = y;            ty = dimX - 1 - x; break;
+    }
+}
+
+void transformGrid(const Symmetry symmetry, const Grid& grid, Grid& image) {
+    image.dimX = grid.dimX;
+    image.dimY = grid.dimY;
+    image.goalX = grid.goalX;
+    image.goalY = grid.goalY;
+    transformPoint(symmetry, grid.dimX, grid.dimY, grid.iX, grid.iY,
+                   image.iX, image.iY);
+    image.cells.resize(grid.dimY);
+
+    for (size_t y = 0; y < grid.dimY; ++y)
+        image.cells[y].resize(grid.dimX);
+
+    for (size_t y = 0; y < grid.dimY; ++y) {
+        for (size_t x = 0; x < grid.dimX; ++x) {
+            size_t tx, ty;
+            transformPoint(symmetry, grid.dimX, grid.dimY, x, y, tx, ty);
+            image.cells[ty][tx] = grid.cells[y][x];
+        }
+    }
+}
+
+void findSymmetries(const Grid& grid) {
+    symmetries.clear();
+    int count = (grid.dimX == grid.dimY) ? 8 : 4;
+
+    for (int i = 1; i < count; ++i) {
+        Symmetry symmetry = Symmetry(i);
+        size_t goalX, goalY;
+        transformPoint(symmetry, grid.dimX, grid.dimY, grid.goalX, grid.goalY,
+                       goalX, goalY);
+
+        if (goalX == grid.goalX && goalY == grid.goalY)
+            symmetries.push_back(symmetry);
+    }
+}
+
+// sets canonical to the least of grid and its images under symmetries
+void canonicalize(const Grid& grid, Grid& canonical) {
+    canonical = grid;
+    Grid image;
+
+    for (vector<Symmetry>::const_iterator i = symmetries.begin();
+         i != symmetries.end(); ++i) {
+
+        transformGrid(*i, grid, image);
+
+        if (image < canonical)
+            canonical = image;
+    }
+}
+
 bool isLoss(const Game& game);
 bool isWin(const Game& game);
 class Apply;
@@ -102,7 +224,8 @@ static tbb::mutex gameQueueMutex;
 static tbb::concurrent_vector<Grid> visitedGrids;
 static priority_queue<Game*, vector<Game*>, GameCompare> gameQueue;
 static Game* dequeueGame();
-static void enqueueGame(Game* game, tbb::parallel_while<Apply>& parallelWhile);
+static void enqueueGames(Game* const* games, size_t count,
+                         tbb::parallel_while<Apply>& parallelWhile);
 
 
 static volatile bool solutionFound = false;
@@ -137,6 +260,8 @@ public:
     }
 
     void operator()(argument_type arg) const {
+        PERF_REGION("Apply");
+
         if (arg) {
             Game* game = dequeueGame();
 
@@ -148,20 +273,29 @@ public:
                     }
                     else if (!isLoss(*game)) {
                         // check if we have already visited this grid before to
-                        // prevent infinite cycles
+                        // prevent infinite cycles, comparing canonical grids
+                        // when symmetry reduction is on
+                        const Grid* visited = &game->grid;
+                        Grid canonical;
+
+                        if (!symmetries.empty()) {
+                            canonicalize(game->grid, canonical);
+                            visited = &canonical;
+                        }
+
                         bool found = false;
 
                         for (tbb::concurrent_vector<Grid>::const_iterator i = visitedGrids.begin();
                              i != visitedGrids.end(); ++i) {
 
-                            if (*i == game->grid) {
+                            if (*i == *visited) {
                                 found = true;
                                 break;
                             }
                         }
 
                         if (!found) {
-                            visitedGrids.push_back(game->grid);
+                            visitedGrids.push_back(*visited);
                             queueNextMoves(*game, _parallelWhile);
                         }
                     }
@@ -189,14 +323,19 @@ static Game* dequeueGame() {
     }
 }
 
-// thread-safe enqueue of Game to priority_queue
-static void enqueueGame(Game* game, tbb::parallel_while<Apply>& parallelWhile) {
+// thread-safe enqueue of Games to priority_queue, taking the lock once for all
+// of them
+static void enqueueGames(Game* const* games, size_t count,
+                         tbb::parallel_while<Apply>& parallelWhile) {
     {
         tbb::mutex::scoped_lock lock(gameQueueMutex);
-        gameQueue.push(game);
+
+        for (size_t i = 0; i < count; ++i)
+            gameQueue.push(games[i]);
     }
 
-    parallelWhile.add(true);
+    for (size_t i = 0; i < count; ++i)
+        parallelWhile.add(true);
 }
 
 // thread-safe get of solution
@@ -213,6 +352,19 @@ static void setSolution(const vector<int>& newSolution) {
         solution = newSolution;
 }
 
+// clears the state left behind by findSolution, so that it can be called again
+static void resetSolver() {
+    visitedGrids.clear();
+
+    while (!gameQueue.empty()) {
+        delete gameQueue.top();
+        gameQueue.pop();
+    }
+
+    solutionFound = false;
+    solution.clear();
+}
+
 void printGrid(const Grid& grid) {
     cout << "goalX = " << grid.goalX << endl;
     cout << "goalY = " << grid.goalY << endl;
@@ -242,6 +394,7 @@ bool isWin(const Game& game) {
 }
 
 void move(const Game& current, Game& next, const Point& nextMove) {
+    PERF_REGION("move");
     next.grid.dimX = current.grid.dimX;
     next.grid.dimY = current.grid.dimY;
     next.grid.goalX = current.grid.goalX;
@@ -335,118 +488,114 @@ void move(const Game& current, Game& next, const Point& nextMove) {
     }
 }
 
-void queueNextMoves(const Game& game, tbb::parallel_while<Apply>& parallelWhile) {
-    Point nextMove;
-    Game* next = new Game;
-
-    nextMove.x = game.grid.iX;
-    nextMove.y = game.grid.iY;
-    move(game, *next, nextMove);
-    next->moves = game.moves;
-    next->moves.push_back(0);
-    enqueueGame(next, parallelWhile);
-
-    if (game.grid.iX > 0) {
-        nextMove.x = game.grid.iX - 1;
-
-        if (game.grid.iY > 0) {
-            nextMove.y = game.grid.iY - 1;
-
-            if (DEAD == game.grid.cells[nextMove.y][nextMove.x]) {
-                next = new Game;
-                move(game, *next, nextMove);
-                next->moves = game.moves;
-                next->moves.push_back(1);
-                enqueueGame(next, parallelWhile);
-            }
-        }
-
-        nextMove.y = game.grid.iY;
-
-        if (DEAD == game.grid.cells[nextMove.y][nextMove.x]) {
-            next = new Game;
-            move(game, *next, nextMove);
-            next->moves = game.moves;
-            next->moves.push_back(8);
-            enqueueGame(next, parallelWhile);
-        }
-
-        if (game.grid.iY < game.grid.dimY - 1) {
-            nextMove.y = game.grid.iY + 1;
+static Cell nextState(const int aliveNeighborCount, const Cell current) {
+    if (aliveNeighborCount < 2 || aliveNeighborCount > 3)
+        return DEAD;
+    else if (aliveNeighborCount == 3)
+        return ALIVE;
+    else
+        return current;
+}
 
-            if (DEAD == game.grid.cells[nextMove.y][nextMove.x]) {
-                next = new Game;
-                move(game, *next, nextMove);
-                next->moves = game.moves;
-                next->moves.push_back(7);
-                enqueueGame(next, parallelWhile);
+// Computes the successors of game for the given moves in one pass, with the
+// same result as calling move for each of them.  All successors share the live
+// cells of the parent other than the intelligent cell, so their neighbor counts
+// and the generation those counts produce are computed once.  Each successor
+// then only recomputes the 3x3 block around the new position of the
+// intelligent cell, which is the only place its live cell changes the counts.
+void expandSuccessors(const Game& game, const Point* const nextMoves,
+                      const int* const moveCodes, const size_t count,
+                      Game** const successors) {
+    PERF_REGION("expandSuccessors");
+    const Grid& grid = game.grid;
+    const int dimX = grid.dimX;
+    const int dimY = grid.dimY;
+
+    CellMatrix live(grid.cells);
+    live[grid.iY][grid.iX] = DEAD;
+
+    vector<vector<int> > aliveNeighborCounts(dimY, vector<int>(dimX, 0));
+    for (int y = 0; y < dimY; ++y) {
+        for (int x = 0; x < dimX; ++x) {
+            if (ALIVE == live[y][x]) {
+                for (int ny = max(y - 1, 0); ny <= min(y + 1, dimY - 1); ++ny) {
+                    for (int nx = max(x - 1, 0); nx <= min(x + 1, dimX - 1); ++nx) {
+                        if (nx != x || ny != y)
+                            ++aliveNeighborCounts[ny][nx];
+                    }
+                }
             }
         }
     }
 
-    nextMove.x = game.grid.iX;
-
-    if (game.grid.iY > 0) {
-        nextMove.y = game.grid.iY - 1;
-
-        if (DEAD == game.grid.cells[nextMove.y][nextMove.x]) {
-            next = new Game;
-            move(game, *next, nextMove);
-            next->moves = game.moves;
-            next->moves.push_back(2);
-            enqueueGame(next, parallelWhile);
+    CellMatrix base(live);
+    for (int y = 0; y < dimY; ++y) {
+        for (int x = 0; x < dimX; ++x) {
+            base[y][x] = nextState(aliveNeighborCounts[y][x], live[y][x]);
         }
     }
 
-    if (game.grid.iY < game.grid.dimY - 1) {
-        nextMove.y = game.grid.iY + 1;
-
-        if (DEAD == game.grid.cells[nextMove.y][nextMove.x]) {
-            next = new Game;
-            move(game, *next, nextMove);
-            next->moves = game.moves;
-            next->moves.push_back(6);
-            enqueueGame(next, parallelWhile);
+    for (size_t i = 0; i < count; ++i) {
+        const int iX = nextMoves[i].x;
+        const int iY = nextMoves[i].y;
+        Game* next = new Game;
+        next->grid.dimX = grid.dimX;
+        next->grid.dimY = grid.dimY;
+        next->grid.goalX = grid.goalX;
+        next->grid.goalY = grid.goalY;
+        next->grid.iX = iX;
+        next->grid.iY = iY;
+        next->grid.cells = base;
+
+        for (int y = max(iY - 1, 0); y <= min(iY + 1, dimY - 1); ++y) {
+            for (int x = max(iX - 1, 0); x <= min(iX + 1, dimX - 1); ++x) {
+                if (x == iX && y == iY)
+                    next->grid.cells[y][x] = nextState(aliveNeighborCounts[y][x], ALIVE);
+                else
+                    next->grid.cells[y][x] = nextState(aliveNeighborCounts[y][x] + 1, live[y][x]);
+            }
         }
+
+        next->moves.reserve(game.moves.size() + 1);
+        next->moves = game.moves;
+        next->moves.push_back(moveCodes[i]);
+        successors[i] = next;
     }
+}
 
-    if (game.grid.iX < game.grid.dimX - 1) {
-        nextMove.x = game.grid.iX + 1;
+void queueNextMoves(const Game& game, tbb::parallel_while<Apply>& parallelWhile) {
+    PERF_REGION("queueNextMoves");
 
-        if (game.grid.iY > 0) {
-            nextMove.y = game.grid.iY - 1;
+    // Moves are queued in the order they always have been: stay, then the
+    // neighbors to the left, above and below, and to the right.  The
+    // intelligent cell can only move to a dead neighbor.
+    static const int moveCodes[] = { 0, 1, 8, 7, 2, 6, 3, 4, 5 };
+    static const int dx[] = { 0, -1, -1, -1, 0, 0, 1, 1, 1 };
+    static const int dy[] = { 0, -1, 0, 1, -1, 1, -1, 0, 1 };
 
-            if (DEAD == game.grid.cells[nextMove.y][nextMove.x]) {
-                next = new Game;
-                move(game, *next, nextMove);
-                next->moves = game.moves;
-                next->moves.push_back(3);
-                enqueueGame(next, parallelWhile);
-            }
-        }
+    Point nextMoves[9];
+    int nextMoveCodes[9];
+    size_t count = 0;
 
-        nextMove.y = game.grid.iY;
+    for (size_t i = 0; i < 9; ++i) {
+        int x = int(game.grid.iX) + dx[i];
+        int y = int(game.grid.iY) + dy[i];
 
-        if (DEAD == game.grid.cells[nextMove.y][nextMove.x]) {
-            next = new Game;
-            move(game, *next, nextMove);
-            next->moves = game.moves;
-            next->moves.push_back(4);
-            enqueueGame(next, parallelWhile);
-        }
+        if (x < 0 || y < 0 || x >= int(game.grid.dimX) || y >= int(game.grid.dimY))
+            continue;
 
-        if (game.grid.iY < game.grid.dimY - 1) {
-            nextMove.y = game.grid.iY + 1;
+        if (0 != moveCodes[i] && DEAD != game.grid.cells[y][x])
+            continue;
 
-            if (DEAD == game.grid.cells[nextMove.y][nextMove.x]) {
-                next = new Game;
-                move(game, *next, nextMove);
-                next->moves = game.moves;
-                next->moves.push_back(5);
-                enqueueGame(next, parallelWhile);
-            }
-        }
+        nextMoves[count].x = x;
+        nextMoves[count].y = y;
+        nextMoveCodes[count] = moveCodes[i];
+        ++count;
     }
+
+    Game* successors[9];
+    expandSuccessors(game, nextMoves, nextMoveCodes, count, successors);
+    enqueueGames(successors, count, parallelWhile);
 }
 
 void findSolution(const Grid& grid) {
@@ -555,9 +704,141 @@ void writeSolutionToOutput(const char* const outFileName) {
     out.close();
 }
 
+// Replays a move string from the starting grid.  Every move must be to a dead
+// neighbor (or 0 to stay), the intelligent cell must survive every generation,
+// and the last generation must be a win.
+bool replayPath(const Grid& grid, const string& moves) {
+    // x and y offsets for moves 0 through 8, matching queueNextMoves
+    static const int dx[] = { 0, -1, 0, 1, 1, 1, 0, -1, -1 };
+    static const int dy[] = { 0, -1, -1, -1, 0, 1, 1, 1, 0 };
+
+    if (moves.empty())
+        return false;
+
+    Game current;
+    current.grid = grid;
+
+    for (string::const_iterator i = moves.begin(); i != moves.end(); ++i) {
+        if (*i < '0' || *i > '8')
+            return false;
+
+        int direction = *i - '0';
+        int x = int(current.grid.iX) + dx[direction];
+        int y = int(current.grid.iY) + dy[direction];
+
+        if (x < 0 || y < 0 || x >= int(current.grid.dimX) || y >= int(current.grid.dimY))
+            return false;
+
+        if (0 != direction && ALIVE == current.grid.cells[y][x])
+            return false;
+
+        Point nextMove;
+        nextMove.x = x;
+        nextMove.y = y;
+        Game next;
+        move(current, next, nextMove);
+
+        if (isLoss(next))
+            return false;
+
+        current.grid = next.grid;
+    }
+
+    return isWin(current);
+}
+
+string readFirstLine(const char* const fileName) {
+    ifstream in(fileName);
+    string line;
+    getline(in, line);
+    return line;
+}
+
+int runVerify(int argc, char** argv) {
+    if (argc < 3) {
+        cerr << "Must specify input file, expected output file, and output file."
+             << endl;
+        return 1;
+    }
+
+    Grid grid;
+    readGridFromInput(argv[0], grid);
+    string expected(readFirstLine(argv[1]));
+    string actual(readFirstLine(argv[2]));
+    bool valid;
+
+    if (expected == "no solution")
+        valid = (actual == expected);
+    else
+        valid = replayPath(grid, expected) && replayPath(grid, actual);
+
+    PERF_REPORT("mazeoflife");
+    cout << argv[2] << ": " << (valid ? "valid" : "invalid") << endl;
+    return valid ? 0 : 1;
+}
+
+// benchmark case solving one grid, where the known answer is just whether the
+// grid is solvable, because the path found depends on thread timing
+class SolveCase {
+public:
+    SolveCase(const Grid& grid, const bool solvable):
+        _grid(grid), _solvable(solvable) {
+    }
+
+    double operator()() {
+        resetSolver();
+        findSolution(this->_grid);
+        return visitedGrids.size();
+    }
+
+    bool ok() const {
+        return solutionFound == this->_solvable;
+    }
+
+private:
+    const Grid _grid;
+    const bool _solvable;
+};
+
+int runBenchmark(int argc, char** argv) {
+    if (argc < 3) {
+        cerr << "Must specify number of runs, then pairs of input file and "
+                "expected output file." << endl;
+        return 1;
+    }
+
+    size_t runs;
+    istringstream(argv[0]) >> runs;
+    vector<int> threadCounts(benchmark::threadCounts());
+    vector<benchmark::Result> results;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        Grid grid;
+        readGridFromInput(argv[i], grid);
+
+        SolveCase solveCase(grid, readFirstLine(argv[i + 1]) != "no solution");
+
+        for (vector<int>::const_iterator threads = threadCounts.begin();
+             threads != threadCounts.end(); ++threads) {
+
+            results.push_back(benchmark::runCase(argv[i], *threads, runs, solveCase));
+        }
+    }
+
+    resetSolver();
+    benchmark::writeResults(cout, "mazeoflife", "states/sec", results);
+    return 0;
+}
+
 int main(int argc, char** argv) {
     tbb::tick_count begin = tbb::tick_count::now();
 
+    if (argc > 1 && string("-bench") == argv[1])
+        return runBenchmark(argc - 2, argv + 2);
+
+    if (argc > 1 && string("-verify") == argv[1])
+        return runVerify(argc - 2, argv + 2);
+
     if (argc < 3) {
         cerr << "Must specify input file and output file." << endl;
         return 1;
@@ -566,10 +847,19 @@ int main(int argc, char** argv) {
     const char* const inFileName = argv[1];
     const char* const outFileName = argv[2];
 
+    int symmetry = 0;
+    if (argc > 3)
+        istringstream(argv[3]) >> symmetry;
+
     Grid grid;
     readGridFromInput(inFileName, grid);
+
+    if (symmetry)
+        findSymmetries(grid);
+
     findSolution(grid);
     writeSolutionToOutput(outFileName);
+    PERF_REPORT("mazeoflife");
     cout << (tbb::tick_count::now() - begin).seconds() << endl;
     return 0;
 }
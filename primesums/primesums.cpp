@@ -20,16 +20,51 @@
 // PerfectPowerFunctor receives a particular prime, it is guaranteed that the
 // shared concurrent_vector already contains all primes less than that prime.
 // PerfectPowerFunctor uses this concurrent_vector to calculate the sums.
-
+//
+// Passing a cache file name after ntoken turns on the prime cache.  If the file
+// already holds all primes up to range end, it is memory-mapped, the sieve is
+// skipped, and PerfectPowerFunctor reads primes straight from the flat mapped
+// array.  Runs sharing a cache file share its pages through the OS page cache.
+// Otherwise the run sieves as usual and then writes the primes it found, so the
+// next run over the same or a smaller range can reuse them.  The file holds a
+// header, the primes as a uint64_t array, and their prefix sums.
+//
+// ./primesums -extend start end maxPower out.txt cacheFile [ntoken] computes
+// incrementally.  After a run, out.txt.state records its range.  A later run
+// with the same max power and a range containing the old one only computes the
+// new (start, end) pairs and appends them to out.txt: sums ending at primes past
+// the old range end, and, if range start moved down, sums starting below the
+// old range start that end at old primes.  The latter use the prefix sums in the
+// prime cache, so each sum costs O(1).  When only range end grows, the file
+// ends up identical to a full run.  Without a usable state file, the run starts
+// from an empty range and truncates out.txt.  The state also records the size of
+// out.txt, so if out.txt was since deleted or truncated, the run starts over too.
+//
+// ./primesums -bench runs start end maxPower expectedCount ... runs the pipeline
+// on each range the given number of times per thread count, and prints timings
+// as JSON (see ../common/benchmark.h).
+
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <vector>
 
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <tbb/concurrent_vector.h>
 #include <tbb/pipeline.h>
 #include <tbb/tick_count.h>
 
+#include "../common/benchmark.h"
+#include "../common/perfcounters.h"
+
 using namespace std;
 using namespace tbb;
 
@@ -53,6 +88,7 @@ public:
     }
 
     size_t operator()(flow_control& fc) const {
+        PERF_REGION("PrimeFunctor");
         size_t nextPrime = 0;
         size_t i = this->_i;
 
@@ -86,42 +122,209 @@ private:
     mutable size_t _i;
 };
 
+// Layout of a prime cache file.  The header is followed by count primes and then
+// count + 1 prefix sums, all as uint64_t.  limit is the number the primes were
+// sieved up to, so the file holds every prime <= limit.
+struct PrimeCacheHeader {
+    char magic[8];
+    uint64_t limit;
+    uint64_t count;
+};
+
+static const char primeCacheMagic[8] = { 'P', 'R', 'I', 'M', 'E', 'S', '0', '1' };
+
+// umask of the process.  umask can only be read by setting it, so main reads it
+// once before any threads start.
+static mode_t fileCreationMask = 022;
+
+struct PrimeCache {
+    const PrimeCacheHeader* header;
+    const uint64_t* primes;
+    const uint64_t* prefixSums;
+    size_t length;
+};
+
+// Maps a prime cache file read-only.  Returns false if the file does not exist
+// or is not a valid cache.
+bool mapPrimeCache(const char* const fileName, PrimeCache& cache) {
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    void* map = MAP_FAILED;
+
+    if (0 == fstat(fd, &st) && size_t(st.st_size) >= sizeof(PrimeCacheHeader))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (MAP_FAILED == map)
+        return false;
+
+    cache.header = static_cast<const PrimeCacheHeader*>(map);
+    cache.length = st.st_size;
+
+    if (!equal(primeCacheMagic, primeCacheMagic + 8, cache.header->magic) ||
+        cache.length != sizeof(PrimeCacheHeader) +
+                        (2 * cache.header->count + 1) * sizeof(uint64_t)) {
+
+        munmap(map, cache.length);
+        return false;
+    }
+
+    cache.primes = reinterpret_cast<const uint64_t*>(cache.header + 1);
+    cache.prefixSums = cache.primes + cache.header->count;
+    return true;
+}
+
+void unmapPrimeCache(PrimeCache& cache) {
+    munmap(const_cast<PrimeCacheHeader*>(cache.header), cache.length);
+}
+
+// Writes the primes found by a run sieving up to limit.  Each run writes its own
+// temporary file, created next to the cache file so rename stays atomic, and
+// renames it into place when complete.  Concurrent runs sharing a cache file
+// therefore never map a partial file or one mixed from two writers.
+bool writePrimeCache(const char* const fileName, const size_t limit) {
+    string tempFileName(string(fileName) + ".XXXXXX");
+    vector<char> tempName(tempFileName.begin(), tempFileName.end());
+    tempName.push_back('\0');
+
+    int fd = mkstemp(&tempName[0]);
+    if (fd < 0)
+        return false;
+
+    // mkstemp creates the file readable by its owner only, so give it the
+    // permissions ofstream would have
+    fchmod(fd, 0666 & ~fileCreationMask);
+
+    FILE* out = fdopen(fd, "wb");
+    if (NULL == out) {
+        close(fd);
+        unlink(&tempName[0]);
+        return false;
+    }
+
+    PrimeCacheHeader header;
+    copy(primeCacheMagic, primeCacheMagic + 8, header.magic);
+    header.limit = limit;
+    header.count = primes.size();
+    bool written = 1 == fwrite(&header, sizeof(header), 1, out);
+
+    for (size_t i = 0; written && i < primes.size(); ++i) {
+        uint64_t prime = primes[i];
+        written = 1 == fwrite(&prime, sizeof(prime), 1, out);
+    }
+
+    uint64_t sum = 0;
+    written = written && 1 == fwrite(&sum, sizeof(sum), 1, out);
+    for (size_t i = 0; written && i < primes.size(); ++i) {
+        sum += primes[i];
+        written = 1 == fwrite(&sum, sizeof(sum), 1, out);
+    }
+
+    written = (0 == fclose(out)) && written;
+
+    if (!written || 0 != rename(&tempName[0], fileName)) {
+        unlink(&tempName[0]);
+        return false;
+    }
+
+    return true;
+}
+
+// emits the prime indices first through count - 1 from a mapped prime cache, in
+// the same order as PrimeFunctor
+class CachedPrimeFunctor {
+public:
+    CachedPrimeFunctor(const size_t first, const size_t count):
+        _count(count), _index(first) {
+    }
+
+    size_t operator()(flow_control& fc) const {
+        PERF_REGION("CachedPrimeFunctor");
+
+        if (this->_index >= this->_count) {
+            fc.stop();
+            return 0;
+        }
+
+        return this->_index++;
+    }
+
+private:
+    const size_t _count;
+    mutable size_t _index;
+};
+
+// PerfectPowerFunctor reads primes through one of these
+class ConcurrentPrimes {
+public:
+    size_t operator[](const size_t index) const {
+        return primes[index];
+    }
+};
+
+class MappedPrimes {
+public:
+    MappedPrimes(const uint64_t* const primes):_primes(primes) {
+    }
+
+    size_t operator[](const size_t index) const {
+        return this->_primes[index];
+    }
+
+private:
+    const uint64_t* const _primes;
+};
+
 struct PerfectPower {
     size_t start, end, sum, base, power;
 };
 
+// appends every way of writing sum as base**power with power <= maxPower
+void addPerfectPowers(const size_t start, const size_t end, const size_t sum,
+                      const size_t maxPower, vector<PerfectPower>& perfectPowers) {
+    for (size_t base = 2, product = base * base;
+         product <= sum;
+         ++base, product = base * base) {
+
+        for (size_t power = 2;
+             power <= maxPower && product <= sum;
+             ++power, product *= base) {
+
+            if (product == sum) {
+                PerfectPower perfectPower;
+                perfectPower.start = start;
+                perfectPower.end = end;
+                perfectPower.sum = sum;
+                perfectPower.base = base;
+                perfectPower.power = power;
+                perfectPowers.push_back(perfectPower);
+            }
+        }
+    }
+}
+
+template <typename Primes>
 class PerfectPowerFunctor {
 public:
-    PerfectPowerFunctor(const size_t maxPower, const size_t rangeStart):
-        _maxPower(maxPower), _rangeStart(rangeStart) {
+    PerfectPowerFunctor(const size_t maxPower, const size_t rangeStart,
+                        const Primes& source = Primes()):
+        _maxPower(maxPower), _rangeStart(rangeStart), _primes(source) {
     }
 
     vector<PerfectPower> operator()(const size_t index) const {
+        PERF_REGION("PerfectPowerFunctor");
         vector<PerfectPower> perfectPowers;
+        const Primes& primes = this->_primes;
 
         size_t sum = primes[index];
         for (size_t j = index - 1; primes[j] >= this->_rangeStart; --j) {
             sum += primes[j];
-
-            for (size_t base = 2, product = base * base;
-                 product <= sum;
-                 ++base, product = base * base) {
-
-                for (size_t power = 2;
-                     power <= this->_maxPower && product <= sum;
-                     ++power, product *= base) {
-
-                    if (product == sum) {
-                        PerfectPower perfectPower;
-                        perfectPower.start = primes[j];
-                        perfectPower.end = primes[index];
-                        perfectPower.sum = sum;
-                        perfectPower.base = base;
-                        perfectPower.power = power;
-                        perfectPowers.push_back(perfectPower);
-                    }
-                }
-            }
+            addPerfectPowers(primes[j], primes[index], sum, this->_maxPower,
+                             perfectPowers);
 
             if (0 == j) break;
         }
@@ -131,6 +334,39 @@ public:
 private:
     const size_t _maxPower;
     const size_t _rangeStart;
+    const Primes _primes;
+};
+
+// Receives the index of a prime that ended a sum in the previous run, and checks
+// the sums ending there that start at the primes with indices in [newStart,
+// oldStart), which the previous run did not cover.  Sums come from the prefix
+// sums in the prime cache.  Starts are visited in descending order, like
+// PerfectPowerFunctor.
+class NewStartsFunctor {
+public:
+    NewStartsFunctor(const PrimeCache& cache, const size_t maxPower,
+                     const size_t newStart, const size_t oldStart):
+        _primes(cache.primes), _prefixSums(cache.prefixSums),
+        _maxPower(maxPower), _newStart(newStart), _oldStart(oldStart) {
+    }
+
+    vector<PerfectPower> operator()(const size_t index) const {
+        PERF_REGION("NewStartsFunctor");
+        vector<PerfectPower> perfectPowers;
+
+        for (size_t j = min(index, this->_oldStart); j-- > this->_newStart;) {
+            size_t sum = this->_prefixSums[index + 1] - this->_prefixSums[j];
+            addPerfectPowers(this->_primes[j], this->_primes[index], sum,
+                             this->_maxPower, perfectPowers);
+        }
+
+        return perfectPowers;
+    }
+
+private:
+    const uint64_t* const _primes;
+    const uint64_t* const _prefixSums;
+    const size_t _maxPower, _newStart, _oldStart;
 };
 
 class OutputFunctor {
@@ -139,6 +375,7 @@ public:
     }
 
     void operator()(const vector<PerfectPower> perfectPowers) const {
+        PERF_REGION("OutputFunctor");
         for (vector<PerfectPower>::const_iterator i = perfectPowers.begin();
              i != perfectPowers.end(); ++i) {
 
@@ -151,8 +388,260 @@ private:
     ostream& _out;
 };
 
+// runs the pipeline over one range, writing results to out
+void findPerfectPowers(const size_t rangeStart, const size_t rangeEnd,
+                       const size_t maxPower, const size_t ntoken, ostream& out) {
+    primes.clear();
+
+    filter_t<void, size_t> f1(filter::serial_in_order,
+                              PrimeFunctor(rangeStart, rangeEnd));
+
+    filter_t<size_t, vector<PerfectPower> > f2(filter::parallel,
+                                               PerfectPowerFunctor<ConcurrentPrimes>(maxPower, rangeStart));
+
+    filter_t<vector<PerfectPower>, void> f3(filter::serial_in_order,
+                                            OutputFunctor(out));
+    parallel_pipeline(ntoken, f1 & f2 & f3);
+}
+
+// same as findPerfectPowers, but reading primes from a mapped prime cache
+// instead of sieving
+void findCachedPerfectPowers(const PrimeCache& cache, const size_t rangeStart,
+                             const size_t rangeEnd, const size_t maxPower,
+                             const size_t ntoken, ostream& out) {
+    size_t count = upper_bound(cache.primes, cache.primes + cache.header->count,
+                               uint64_t(rangeEnd)) - cache.primes;
+
+    filter_t<void, size_t> f1(filter::serial_in_order,
+                              CachedPrimeFunctor(1, count));
+
+    filter_t<size_t, vector<PerfectPower> > f2(filter::parallel,
+                                               PerfectPowerFunctor<MappedPrimes>(maxPower, rangeStart,
+                                                                                 MappedPrimes(cache.primes)));
+
+    filter_t<vector<PerfectPower>, void> f3(filter::serial_in_order,
+                                            OutputFunctor(out));
+    parallel_pipeline(ntoken, f1 & f2 & f3);
+}
+
+// sieves all primes up to rangeEnd into primes, without checking any sums
+void sievePrimes(const size_t rangeEnd) {
+    primes.clear();
+    vector<bool> composite(rangeEnd + 1, false);
+
+    for (size_t i = 2; i <= rangeEnd; ++i) {
+        if (!composite[i]) {
+            primes.push_back(i);
+
+            for (size_t j = i * i; j <= rangeEnd; j += i) {
+                composite[j] = true;
+            }
+        }
+    }
+}
+
+// range and max power covered by the output of a previous -extend run
+// outputSize is the size of the output file when the state was written, so that
+// a state file left behind by a deleted or truncated output is not trusted.
+struct ExtendState {
+    size_t rangeStart, rangeEnd, maxPower, outputSize;
+};
+
+bool readExtendState(const string& fileName, ExtendState& state) {
+    ifstream in(fileName.c_str());
+    in >> state.rangeStart >> state.rangeEnd >> state.maxPower >> state.outputSize;
+    return !in.fail();
+}
+
+void writeExtendState(const string& fileName, const ExtendState& state) {
+    ofstream out(fileName.c_str());
+    out << state.rangeStart << " " << state.rangeEnd << " " << state.maxPower
+        << " " << state.outputSize << endl;
+}
+
+// Returns false if the file does not exist.
+bool getFileSize(const string& fileName, size_t& size) {
+    struct stat st;
+    if (0 != stat(fileName.c_str(), &st))
+        return false;
+
+    size = st.st_size;
+    return true;
+}
+
+int runExtend(int argc, char** argv) {
+    if (argc < 5) {
+        cerr << "Must specify range start, range end, max power, output file "
+                "name, and prime cache file name." << endl;
+        return 1;
+    }
+
+    ExtendState state;
+    istringstream(argv[0]) >> state.rangeStart;
+    istringstream(argv[1]) >> state.rangeEnd;
+    istringstream(argv[2]) >> state.maxPower;
+    const string outFileName(argv[3]);
+    const char* const cacheFileName = argv[4];
+    const string stateFileName(outFileName + ".state");
+
+    size_t ntoken = 100;
+    if (argc > 5)
+        istringstream(argv[5]) >> ntoken;
+
+    // A previous run can only be extended if this range contains it, and its
+    // output is still as it left it.  Otherwise, start over from an empty range
+    // ending at 2, which no sum can end at.
+    ExtendState previous;
+    size_t outputSize;
+    bool extending = readExtendState(stateFileName, previous) &&
+                     getFileSize(outFileName, outputSize) &&
+                     previous.outputSize == outputSize &&
+                     previous.maxPower == state.maxPower &&
+                     previous.rangeStart >= state.rangeStart &&
+                     previous.rangeEnd <= state.rangeEnd;
+
+    if (!extending) {
+        previous = state;
+        previous.rangeEnd = 2;
+    }
+
+    PrimeCache cache;
+    bool cached = mapPrimeCache(cacheFileName, cache);
+
+    if (!cached || cache.header->limit < state.rangeEnd) {
+        if (cached)
+            unmapPrimeCache(cache);
+
+        sievePrimes(state.rangeEnd);
+
+        if (!writePrimeCache(cacheFileName, state.rangeEnd) ||
+            !mapPrimeCache(cacheFileName, cache)) {
+
+            cerr << "Could not write prime cache " << cacheFileName << endl;
+            return 1;
+        }
+    }
+
+    const uint64_t* const first = cache.primes;
+    const uint64_t* const last = cache.primes + cache.header->count;
+    size_t oldCount = upper_bound(first, last, uint64_t(previous.rangeEnd)) - first;
+    size_t newCount = upper_bound(first, last, uint64_t(state.rangeEnd)) - first;
+    size_t oldStart = lower_bound(first, last, uint64_t(previous.rangeStart)) - first;
+    size_t newStart = lower_bound(first, last, uint64_t(state.rangeStart)) - first;
+
+    ofstream out(outFileName.c_str(), extending ? ios::app : ios::trunc);
+
+    // sums ending at old primes, starting below the old range start
+    if (newStart < oldStart) {
+        filter_t<void, size_t> f1(filter::serial_in_order,
+                                  CachedPrimeFunctor(1, oldCount));
+
+        filter_t<size_t, vector<PerfectPower> > f2(filter::parallel,
+                                                   NewStartsFunctor(cache, state.maxPower,
+                                                                    newStart, oldStart));
+
+        filter_t<vector<PerfectPower>, void> f3(filter::serial_in_order,
+                                                OutputFunctor(out));
+        parallel_pipeline(ntoken, f1 & f2 & f3);
+    }
+
+    // sums ending at new primes
+    filter_t<void, size_t> f1(filter::serial_in_order,
+                              CachedPrimeFunctor(max(oldCount, size_t(1)), newCount));
+
+    filter_t<size_t, vector<PerfectPower> > f2(filter::parallel,
+                                               PerfectPowerFunctor<MappedPrimes>(state.maxPower, state.rangeStart,
+                                                                                 MappedPrimes(cache.primes)));
+
+    filter_t<vector<PerfectPower>, void> f3(filter::serial_in_order,
+                                            OutputFunctor(out));
+    parallel_pipeline(ntoken, f1 & f2 & f3);
+
+    out.close();
+    unmapPrimeCache(cache);
+
+    if (!getFileSize(outFileName, state.outputSize)) {
+        cerr << "Could not write " << outFileName << endl;
+        return 1;
+    }
+
+    writeExtendState(stateFileName, state);
+    PERF_REPORT("primesums");
+    return 0;
+}
+
+// benchmark case for one range, where the known answer is the number of
+// perfect powers found
+class SumsCase {
+public:
+    SumsCase(const size_t rangeStart, const size_t rangeEnd,
+             const size_t maxPower, const size_t expectedCount):
+        _rangeStart(rangeStart), _rangeEnd(rangeEnd), _maxPower(maxPower),
+        _expectedCount(expectedCount), _count(0) {
+    }
+
+    double operator()() {
+        ostringstream out;
+        findPerfectPowers(this->_rangeStart, this->_rangeEnd, this->_maxPower,
+                          100, out);
+        string results(out.str());
+        this->_count = count(results.begin(), results.end(), '\n');
+        return primes.size();
+    }
+
+    bool ok() const {
+        return this->_count == this->_expectedCount;
+    }
+
+private:
+    const size_t _rangeStart, _rangeEnd, _maxPower, _expectedCount;
+    size_t _count;
+};
+
+int runBenchmark(int argc, char** argv) {
+    if (argc < 5) {
+        cerr << "Must specify number of runs, then groups of range start, "
+                "range end, max power, and expected count." << endl;
+        return 1;
+    }
+
+    size_t runs;
+    istringstream(argv[0]) >> runs;
+    vector<int> threadCounts(benchmark::threadCounts());
+    vector<benchmark::Result> results;
+
+    for (int i = 1; i + 3 < argc; i += 4) {
+        size_t rangeStart, rangeEnd, maxPower, expectedCount;
+        istringstream(argv[i]) >> rangeStart;
+        istringstream(argv[i + 1]) >> rangeEnd;
+        istringstream(argv[i + 2]) >> maxPower;
+        istringstream(argv[i + 3]) >> expectedCount;
+        SumsCase sumsCase(rangeStart, rangeEnd, maxPower, expectedCount);
+
+        ostringstream name;
+        name << rangeStart << ":" << rangeEnd << ":" << maxPower;
+
+        for (vector<int>::const_iterator threads = threadCounts.begin();
+             threads != threadCounts.end(); ++threads) {
+
+            results.push_back(benchmark::runCase(name.str(), *threads, runs, sumsCase));
+        }
+    }
+
+    benchmark::writeResults(cout, "primesums", "primes/sec", results);
+    return 0;
+}
+
 int main(int argc, char** argv) {
     tick_count begin = tick_count::now();
+    fileCreationMask = umask(0);
+    umask(fileCreationMask);
+
+    if (argc > 1 && string("-bench") == argv[1])
+        return runBenchmark(argc - 2, argv + 2);
+
+    if (argc > 1 && string("-extend") == argv[1])
+        return runExtend(argc - 2, argv + 2);
 
     if (argc < 5) {
         cerr << "Must specify range start, range end, max power, and output "
@@ -179,15 +668,27 @@ int main(int argc, char** argv) {
     else
         ntoken = 100;
 
-    filter_t<void, size_t> f1(filter::serial_in_order,
-                              PrimeFunctor(rangeStart, rangeEnd));
+    const char* const cacheFileName = (argc > 6) ? argv[6] : NULL;
+    PrimeCache cache;
+    bool cached = (NULL != cacheFileName) && mapPrimeCache(cacheFileName, cache);
 
-    filter_t<size_t, vector<PerfectPower> > f2(filter::parallel,
-                                               PerfectPowerFunctor(maxPower, rangeStart));
+    if (cached && cache.header->limit < rangeEnd) {
+        unmapPrimeCache(cache);
+        cached = false;
+    }
 
-    filter_t<vector<PerfectPower>, void> f3(filter::serial_in_order,
-                                            OutputFunctor(out));
-    parallel_pipeline(ntoken, f1 & f2 & f3);
+    if (cached) {
+        findCachedPerfectPowers(cache, rangeStart, rangeEnd, maxPower, ntoken, out);
+        unmapPrimeCache(cache);
+    }
+    else {
+        findPerfectPowers(rangeStart, rangeEnd, maxPower, ntoken, out);
+
+        if (NULL != cacheFileName && !writePrimeCache(cacheFileName, rangeEnd))
+            cerr << "Could not write prime cache " << cacheFileName << endl;
+    }
+
+    PERF_REPORT("primesums");
 
     cout << (tick_count::now() - begin).seconds() << endl;
     return 0;
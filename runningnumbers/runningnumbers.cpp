@@ -4,14 +4,40 @@
 
 // ./runningnumbers 1BFC91544B9CBF9E5B93FFCAB7273070 38040301052B0163A103400502060501 05ED2F440000B17B0000000100000036
 
+// The cycle count is kept in 128 bits, because adversarial inputs can run for
+// more than 2^64 cycles.  When the byte increment is all zeroes, the buffer only
+// changes on every 37th cycle, and the count is solved in closed form instead of
+// stepping through up to 37 * 2^32 cycles.  Long brute-force runs print progress
+// lines to stderr so that runaway jobs can be spotted and killed.  Optionally,
+// the buffer state of a sampled or windowed set of cycles can be traced to
+// stdout.
+
+// Buffers of up to 8 cells (256 bits) are stepped entirely in SSE registers,
+// using one byte-wise or dword-wise vector add per cycle.  Larger buffers fall
+// back to the generic loop over heap cells.  Building with
+// -DGENERIC_CYCLES_ONLY disables the register kernels for benchmarking.
+
+// ./runningnumbers -bench runs source byteInc dwordInc expectedCount ... steps
+// each triple the given number of times, and prints timings as JSON (see
+// ../common/benchmark.h).  The stepping loop is serial, so it is only timed
+// with 1 thread.
+
 #include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <stdint.h>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <tbb/tick_count.h>
 
+#include "../common/benchmark.h"
+#include "../common/perfcounters.h"
+
 using namespace std;
 using namespace tbb;
 
@@ -19,6 +45,9 @@ typedef uint8_t byte;
 typedef uint16_t word;
 typedef uint32_t dword;
 
+// gcc 4.5 has no __uint128_t, but it does support the TImode attribute.
+typedef unsigned int uint128 __attribute__((mode(TI)));
+
 union buffercell {
     byte bufferbytes[4];
     word bufferword[2];
@@ -48,7 +77,97 @@ struct buffer {
 
         return !result;
     }
+
+    dword cell(const size_t j) const {
+        return this->cells[j].bufferdword;
+    }
+
+    // The byte stores could alias size and cells, which would force them to be
+    // reloaded after every store, so they are read into locals first.
+    void addDwords(const buffer& inc) {
+        const size_t size = this->size;
+        buffercell* __restrict__ cells = this->cells;
+        const buffercell* __restrict__ incCells = inc.cells;
+
+        for (size_t j = 0; j < size; ++j) {
+            cells[j].bufferdword += incCells[j].bufferdword;
+        }
+    }
+
+    void addBytes(const buffer& inc) {
+        const size_t size = this->size;
+        buffercell* __restrict__ cells = this->cells;
+        const buffercell* __restrict__ incCells = inc.cells;
+
+        for (size_t j = 0; j < size; ++j) {
+            for (size_t k = 0; k < 4; ++k) {
+                cells[j].bufferbytes[k] += incCells[j].bufferbytes[k];
+            }
+        }
+    }
+};
+
+#ifdef __SSE2__
+// Buffer of up to 4 * Registers cells held in SSE registers, with the same
+// interface as buffer.  Unused cells are padded with zeroes.  Their increments
+// are zero too, so they stay zero and never affect the comparisons.  The loops
+// over Registers have constant bounds and are fully unrolled.
+template <size_t Registers>
+struct registerbuffer {
+    size_t size;
+    __m128i lanes[Registers];
+
+    // Loads the first size cells of buf.  Every buffer is loaded with the size of
+    // source, like the generic loop, which ignores increment cells past the end
+    // of source.  Missing cells are zero.
+    registerbuffer(const buffer& buf, const size_t size):size(size) {
+        dword cells[4 * Registers];
+        fill(cells, cells + 4 * Registers, 0);
+
+        for (size_t j = 0; j < min(buf.size, size); ++j)
+            cells[j] = buf.cells[j].bufferdword;
+
+        for (size_t r = 0; r < Registers; ++r)
+            this->lanes[r] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cells + 4 * r));
+    }
+
+    bool isZero() const {
+        __m128i zero = _mm_setzero_si128();
+        __m128i equal = _mm_cmpeq_epi32(this->lanes[0], zero);
+
+        for (size_t r = 1; r < Registers; ++r)
+            equal = _mm_and_si128(equal, _mm_cmpeq_epi32(this->lanes[r], zero));
+
+        return 0xFFFF == _mm_movemask_epi8(equal);
+    }
+
+    bool operator!=(const registerbuffer& other) const {
+        __m128i equal = _mm_cmpeq_epi32(this->lanes[0], other.lanes[0]);
+
+        for (size_t r = 1; r < Registers; ++r)
+            equal = _mm_and_si128(equal, _mm_cmpeq_epi32(this->lanes[r], other.lanes[r]));
+
+        return 0xFFFF != _mm_movemask_epi8(equal);
+    }
+
+    // only used for tracing, so it is fine to go through memory
+    dword cell(const size_t j) const {
+        dword cells[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(cells), this->lanes[j / 4]);
+        return cells[j % 4];
+    }
+
+    void addDwords(const registerbuffer& inc) {
+        for (size_t r = 0; r < Registers; ++r)
+            this->lanes[r] = _mm_add_epi32(this->lanes[r], inc.lanes[r]);
+    }
+
+    void addBytes(const registerbuffer& inc) {
+        for (size_t r = 0; r < Registers; ++r)
+            this->lanes[r] = _mm_add_epi8(this->lanes[r], inc.lanes[r]);
+    }
 };
+#endif
 
 buffer parseBuffer(const char* const in) {
     string str(in);
@@ -70,9 +189,351 @@ buffer parseBuffer(const char* const in) {
     return buf;
 }
 
+string toDecimal(uint128 n) {
+    char digits[40];
+    char* p = digits + sizeof(digits);
+    *--p = '\0';
+
+    do {
+        *--p = '0' + static_cast<char>(n % 10);
+        n /= 10;
+    } while (n != 0);
+
+    return string(p);
+}
+
+// Finds all m such that m * d == t (mod 2^32).  On success, the solutions are
+// exactly m == residue (mod 2^bits).  Returns false when there is no solution.
+bool solveCongruence(const dword d, const dword t, uint64_t& residue,
+                     unsigned int& bits) {
+    if (0 == d) {
+        residue = 0;
+        bits = 0;
+        return 0 == t;
+    }
+
+    unsigned int v = __builtin_ctz(d);
+    if (t & ((dword(1) << v) - 1))
+        return false;
+
+    // Newton's iteration for the inverse of an odd number mod 2^32.
+    dword odd = d >> v;
+    dword inverse = odd;
+    for (size_t i = 0; i < 5; ++i)
+        inverse *= 2 - odd * inverse;
+
+    bits = 32 - v;
+    residue = uint64_t(dword((t >> v) * inverse)) & ((uint64_t(1) << bits) - 1);
+    return true;
+}
+
+// Finds the smallest m >= 1 such that adding dwordInc to source m times gives
+// back source, or gives all zeroes if toZero is set.  Returns false if no such
+// m exists.
+bool solveDwordSteps(const buffer& source, const buffer& dwordInc,
+                     const bool toZero, uint64_t& steps) {
+    uint64_t residue = 0;
+    unsigned int bits = 0;
+
+    for (size_t j = 0; j < source.size; ++j) {
+        dword t = toZero ? dword(0 - source.cells[j].bufferdword) : 0;
+        uint64_t laneResidue;
+        unsigned int laneBits;
+
+        if (!solveCongruence(dwordInc.cells[j].bufferdword, t, laneResidue, laneBits))
+            return false;
+
+        // all moduli are powers of 2, so the congruences are compatible only if
+        // the finer one reduces to the coarser one
+        if (laneBits > bits) {
+            if ((laneResidue & ((uint64_t(1) << bits) - 1)) != residue)
+                return false;
+
+            residue = laneResidue;
+            bits = laneBits;
+        }
+        else if ((residue & ((uint64_t(1) << laneBits) - 1)) != laneResidue) {
+            return false;
+        }
+    }
+
+    steps = (0 != residue) ? residue : (uint64_t(1) << bits);
+    return true;
+}
+
+// Closed form for a zero byte increment.  Only the dword cycles (0, 37, 74, ...)
+// change the buffer, so the answer is the first dword cycle at which the buffer
+// returns to source or reaches zero.
+uint128 countDwordOnlyCycles(const buffer& source, const buffer& dwordInc) {
+    uint64_t steps;
+    solveDwordSteps(source, dwordInc, false, steps);
+
+    uint64_t zeroSteps;
+    if (solveDwordSteps(source, dwordInc, true, zeroSteps) && zeroSteps < steps)
+        steps = zeroSteps;
+
+    return uint128(37) * (steps - 1) + 1;
+}
+
+// Prints the cycle count and rate to stderr, at most once per interval.  The
+// caller only checks in every 2^24 cycles, so reading the clock stays out of
+// the hot loop.
+class ProgressReporter {
+public:
+    static const uint64_t checkMask = (uint64_t(1) << 24) - 1;
+
+    ProgressReporter(const double interval, const tick_count begin):
+        _interval(interval), _begin(begin), _last(begin), _lastCount(0) {
+    }
+
+    // Kept out of line, so that the clock and floating point code does not
+    // compete with the cycle loop for registers.
+    __attribute__((noinline)) void check(const uint128 count) {
+        if (this->_interval <= 0)
+            return;
+
+        tick_count now = tick_count::now();
+        double sinceLast = (now - this->_last).seconds();
+
+        if (sinceLast >= this->_interval) {
+            double rate = double(count - this->_lastCount) / sinceLast;
+            cerr << "progress: " << toDecimal(count) << " cycles, "
+                 << (now - this->_begin).seconds() << " sec, "
+                 << rate << " cycles/sec" << endl;
+            this->_last = now;
+            this->_lastCount = count;
+        }
+    }
+
+private:
+    const double _interval;
+    const tick_count _begin;
+    tick_count _last;
+    uint128 _lastCount;
+};
+
+// Tracer that does nothing.  countCycles<NullTracer> compiles down to the same
+// loop as a build without tracing.
+class NullTracer {
+public:
+    bool wants(const uint128) const {
+        return false;
+    }
+
+    template <typename Buffer>
+    void operator()(const uint128, const Buffer&) {
+    }
+};
+
+// Writes the buffer state of cycles first, first + stride, first + 2 * stride,
+// ... up to last, with one group of 8 hex digits per dword cell:
+//
+// Cycle 0001: 21E9C098 4B9D7119 5B93FFCB B72730A6
+//
+// Lines are formatted by hand into a local buffer and written to the stream in
+// large blocks, so tracing does not go through iostream formatting per cycle.
+class CycleTracer {
+public:
+    CycleTracer(ostream& out, const uint128 first, const uint128 last,
+                const uint128 stride):
+        _out(out), _next(first), _last(last), _stride(stride), _length(0) {
+
+        // cycles are counted from 1, and an empty window traces nothing
+        if (0 == this->_next)
+            this->_next = 1;
+        if (this->_next > this->_last)
+            this->_next = 0;
+    }
+
+    ~CycleTracer() {
+        this->flush();
+    }
+
+    bool wants(const uint128 count) const {
+        return count == this->_next;
+    }
+
+    template <typename Buffer>
+    void operator()(const uint128 count, const Buffer& cycling) {
+        this->_next = (count <= this->_last && this->_last - count >= this->_stride) ?
+            count + this->_stride : 0;
+
+        if (this->_length + lineCapacity(cycling.size) > sizeof(this->_buffer))
+            this->flush();
+
+        this->append("Cycle ", 6);
+
+        string number(toDecimal(count));
+        for (size_t pad = number.length(); pad < 4; ++pad)
+            this->_buffer[this->_length++] = '0';
+        this->append(number.data(), number.length());
+
+        this->append(": ", 2);
+
+        for (size_t j = 0; j < cycling.size; ++j) {
+            if (j > 0)
+                this->_buffer[this->_length++] = ' ';
+
+            dword value = cycling.cell(j);
+            for (int shift = 28; shift >= 0; shift -= 4)
+                this->_buffer[this->_length++] = "0123456789ABCDEF"[(value >> shift) & 0xF];
+        }
+
+        this->_buffer[this->_length++] = '\n';
+    }
+
+    void flush() {
+        this->_out.write(this->_buffer, this->_length);
+        this->_out.flush();
+        this->_length = 0;
+    }
+
+private:
+    static size_t lineCapacity(const size_t size) {
+        // "Cycle " + 39 digits + ": " + 9 chars per cell
+        return 6 + 39 + 2 + 9 * size;
+    }
+
+    ostream& _out;
+    uint128 _next;
+    const uint128 _last, _stride;
+    char _buffer[64 * 1024];
+    size_t _length;
+
+    void append(const char* const chars, const size_t length) {
+        copy(chars, chars + length, this->_buffer + this->_length);
+        this->_length += length;
+    }
+};
+
+// Steps cycling until it returns to source or reaches zero, and returns the
+// number of cycles taken.  The tracer is asked about each cycle number (counting
+// from 1) and called with the buffer state after the cycles it wants.
+template <typename Buffer, typename Tracer>
+uint128 countCycles(const Buffer& source, Buffer& cycling, const Buffer& byteInc,
+                    const Buffer& dwordInc, ProgressReporter& progress,
+                    Tracer& tracer) {
+    PERF_REGION("countCycles");
+
+    // Work on local copies, so that the buffers stay in registers even when this
+    // is not inlined into the caller that owns them.  The calls to progress and
+    // tracer could otherwise modify them as far as the compiler knows.
+    const Buffer localSource(source), localByteInc(byteInc), localDwordInc(dwordInc);
+    Buffer localCycling(cycling);
+
+    // phase tracks i % 37 without a 128-bit division on every cycle
+    uint128 i = 0;
+    size_t phase = 0;
+    do {
+        if (0 == phase)
+            localCycling.addDwords(localDwordInc);
+        else
+            localCycling.addBytes(localByteInc);
+
+        if (37 == ++phase)
+            phase = 0;
+
+        if (tracer.wants(++i))
+            tracer(i, localCycling);
+
+        if (0 == (uint64_t(i) & ProgressReporter::checkMask))
+            progress.check(i);
+    } while (localSource != localCycling && !localCycling.isZero());
+
+    cycling = localCycling;
+    return i;
+}
+
+#ifdef __SSE2__
+template <size_t Registers, typename Tracer>
+uint128 countRegisterCycles(const buffer& source, const buffer& byteInc,
+                            const buffer& dwordInc, ProgressReporter& progress,
+                            Tracer& tracer) {
+    registerbuffer<Registers> sourceRegisters(source, source.size);
+    registerbuffer<Registers> cyclingRegisters(source, source.size);
+    registerbuffer<Registers> byteIncRegisters(byteInc, source.size);
+    registerbuffer<Registers> dwordIncRegisters(dwordInc, source.size);
+    return countCycles(sourceRegisters, cyclingRegisters, byteIncRegisters,
+                       dwordIncRegisters, progress, tracer);
+}
+#endif
+
+// picks the register kernel for the buffer size, or the generic loop
+template <typename Tracer>
+uint128 dispatchCycles(const buffer& source, buffer& cycling, const buffer& byteInc,
+                       const buffer& dwordInc, ProgressReporter& progress,
+                       Tracer& tracer) {
+#if defined(__SSE2__) && !defined(GENERIC_CYCLES_ONLY)
+    if (source.size <= 4)
+        return countRegisterCycles<1>(source, byteInc, dwordInc, progress, tracer);
+    else if (source.size <= 8)
+        return countRegisterCycles<2>(source, byteInc, dwordInc, progress, tracer);
+#endif
+
+    return countCycles(source, cycling, byteInc, dwordInc, progress, tracer);
+}
+
+// benchmark case for one hex triple with a known cycle count
+class CyclesCase {
+public:
+    CyclesCase(const char* const source, const char* const byteInc,
+               const char* const dwordInc, const string& expectedCount):
+        _source(parseBuffer(source)), _cycling(parseBuffer(source)),
+        _byteInc(parseBuffer(byteInc)), _dwordInc(parseBuffer(dwordInc)),
+        _expectedCount(expectedCount) {
+    }
+
+    double operator()() {
+        copy(this->_source.cells, this->_source.cells + this->_source.size,
+             this->_cycling.cells);
+        ProgressReporter progress(0, tick_count::now());
+        NullTracer tracer;
+        uint128 count = dispatchCycles(this->_source, this->_cycling,
+                                       this->_byteInc, this->_dwordInc,
+                                       progress, tracer);
+        this->_count = toDecimal(count);
+        return double(count);
+    }
+
+    bool ok() const {
+        return this->_count == this->_expectedCount;
+    }
+
+private:
+    const buffer _source;
+    buffer _cycling;
+    const buffer _byteInc, _dwordInc;
+    const string _expectedCount;
+    string _count;
+};
+
+int runBenchmark(int argc, char** argv) {
+    if (argc < 5) {
+        cerr << "Must specify number of runs, then groups of source, byte "
+                "increment, dword increment, and expected count." << endl;
+        return 1;
+    }
+
+    size_t runs;
+    istringstream(argv[0]) >> runs;
+    vector<benchmark::Result> results;
+
+    for (int i = 1; i + 3 < argc; i += 4) {
+        CyclesCase cyclesCase(argv[i], argv[i + 1], argv[i + 2], argv[i + 3]);
+        string name(string(argv[i]) + " " + argv[i + 1] + " " + argv[i + 2]);
+        results.push_back(benchmark::runCase(name, 1, runs, cyclesCase));
+    }
+
+    benchmark::writeResults(cout, "runningnumbers", "cycles/sec", results);
+    return 0;
+}
+
 int main(int argc, char** argv) {
     tick_count begin = tick_count::now();
 
+    if (argc > 1 && string("-bench") == argv[1])
+        return runBenchmark(argc - 2, argv + 2);
+
     if (argc < 4) {
         cerr << "Must specify source, byte increment, and dword increment."
              << endl;
@@ -84,34 +545,42 @@ int main(int argc, char** argv) {
     buffer byteInc(parseBuffer(argv[2]));
     buffer dwordInc(parseBuffer(argv[3]));
 
-    size_t i =0;
-    for (; i == 0 || (source != cycling && !cycling.isZero()); ++i) {
-        if (!(i % 37)) {
-            for (size_t j = 0; j < cycling.size; ++j) {
-                cycling.cells[j].bufferdword += dwordInc.cells[j].bufferdword;
-            }
-        }
-        else {
-            for (size_t j = 0; j < cycling.size; ++j) {
-                for (size_t k = 0; k < 4; ++k) {
-                    cycling.cells[j].bufferbytes[k] += byteInc.cells[j].bufferbytes[k];
-                }
-            }
-        }
+    // Progress is reported every 10 seconds by default.  Pass an extra argument
+    // to change the interval, or 0 to turn progress reporting off.
+    double progressInterval = 10;
+    if (argc > 4)
+        istringstream(argv[4]) >> progressInterval;
 
-        /*
-        cout << "Cycle " << dec << setw(4) << setfill('0') << i + 1 << ": ";
+    // Tracing is off by default.  Pass a stride N to print every Nth cycle,
+    // optionally followed by the first and last cycle to print.
+    uint64_t traceStride = 0, traceFirst = 1, traceLast = ~uint64_t(0);
+    if (argc > 5)
+        istringstream(argv[5]) >> traceStride;
+    if (argc > 6)
+        istringstream(argv[6]) >> traceFirst;
+    if (argc > 7)
+        istringstream(argv[7]) >> traceLast;
 
-        for (size_t j = 0; j < cycling.size; ++j) {
-            if (j > 0) cout << " ";
-            cout << hex << setw(8) << setfill('0') << uppercase << cycling.cells[j].bufferdword;
-        }
+    uint128 count;
 
-        cout << endl;
-        */
+    if (0 == traceStride && byteInc.isZero()) {
+        count = countDwordOnlyCycles(source, dwordInc);
+    }
+    else {
+        ProgressReporter progress(progressInterval, begin);
+
+        if (0 == traceStride) {
+            NullTracer tracer;
+            count = dispatchCycles(source, cycling, byteInc, dwordInc, progress, tracer);
+        }
+        else {
+            CycleTracer tracer(cout, traceFirst, traceLast, traceStride);
+            count = dispatchCycles(source, cycling, byteInc, dwordInc, progress, tracer);
+        }
     }
 
-    cout << i << endl;
+    PERF_REPORT("runningnumbers");
+    cout << toDecimal(count) << endl;
     cout << (tick_count::now() - begin).seconds() << endl;
     return 0;
 }